@@ -1,6 +1,9 @@
+attribute vec2 xz;
+attribute float height;
 varying vec4 pos;
 
 void main() {
-  gl_Position = gl_ModelViewProjectionMatrix * gl_Vertex;
-  pos = gl_Vertex;
+  vec4 vertex = vec4(xz.x,height,xz.y,1);
+  gl_Position = gl_ModelViewProjectionMatrix * vertex;
+  pos = vertex;
 }
@@ -1,3 +1,6 @@
+attribute vec2 xz;
+attribute float height;
+
 void main() {
-  gl_Position = gl_ModelViewProjectionMatrix * gl_Vertex;
+  gl_Position = gl_ModelViewProjectionMatrix * vec4(xz.x,height,xz.y,1);
 }
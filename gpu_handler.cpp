@@ -3,16 +3,27 @@
 void Fatal(const char* format, ...) {
   va_list args;
   va_start(args,format);
-  fprintf(stderr, format, args);
+  vfprintf(stderr, format, args);
   va_end(args);
   exit(1);
 }
 
 gpu_handler::gpu_handler(size_t _work_size) {
   work_size = _work_size;
+  kernel = NULL;
   init_GPU();
 }
 
+gpu_handler::~gpu_handler() {
+  // Release kernels and programs
+  for (std::map<std::string, cl_kernel>::iterator it=kernels.begin(); it!=kernels.end(); ++it)
+    clReleaseKernel(it->second);
+  for (std::map<std::string, cl_program>::iterator it=programs.begin(); it!=programs.end(); ++it)
+    clReleaseProgram(it->second);
+  clReleaseCommandQueue(queue);
+  clReleaseContext(context);
+}
+
 // Initialize the gpu for use
 void gpu_handler::init_GPU() {
   int n_entries = 1024;
@@ -51,6 +62,9 @@ void gpu_handler::init_GPU() {
   }
   // Check thread count
   if (clGetDeviceInfo(device_id,CL_DEVICE_MAX_WORK_GROUP_SIZE,sizeof(max_n_work_items),&max_n_work_items,NULL)) Fatal("Could not get max work group size\n");
+  // Check memory limits
+  if (clGetDeviceInfo(device_id,CL_DEVICE_MAX_MEM_ALLOC_SIZE,sizeof(max_alloc_size),&max_alloc_size,NULL)) Fatal("Could not get max allocation size\n");
+  if (clGetDeviceInfo(device_id,CL_DEVICE_GLOBAL_MEM_SIZE,sizeof(global_mem_size),&global_mem_size,NULL)) Fatal("Could not get global memory size\n");
   // Create OpenCL context
   cl_int error;
   context = clCreateContext(0,1,&device_id,NULL,NULL,&error);
@@ -68,14 +82,20 @@ cl_mem gpu_handler::create_buffer(cl_mem_flags flags, size_t size, void* host_pt
   return ret;
 }
 
-// If the mode changed, create a new kernel
-void gpu_handler::create_kernel(const char* source, const char* name) {
+// Build a kernel with the given build options and make it current, each variant is only compiled once
+cl_kernel gpu_handler::create_kernel(const char* source, const char* name, const char* options) {
+  std::string key = std::string(name) + " " + options;
+  std::map<std::string, cl_kernel>::iterator cached = kernels.find(key);
+  if (cached != kernels.end()) {
+    kernel = cached->second;
+    return kernel;
+  }
   cl_int error;
   // Compile Kernel  
-  program = clCreateProgramWithSource(context,1,&source,0,&error);
+  cl_program program = clCreateProgramWithSource(context,1,&source,0,&error);
   if (error) Fatal("Cannot create program\n");
   int ret;
-  if ((ret = clBuildProgram(program,0,NULL,NULL,NULL,NULL))) {
+  if ((ret = clBuildProgram(program,0,NULL,options,NULL,NULL))) {
     // If error occurred, get reason why
     char log[1048576];
     if ((ret = clGetProgramBuildInfo(program,device_id,CL_PROGRAM_BUILD_LOG,sizeof(log),log,NULL))) {
@@ -86,6 +106,14 @@ void gpu_handler::create_kernel(const char* source, const char* name) {
   }
   kernel = clCreateKernel(program,name,&error);
   if (error) Fatal("Cannot create kernel\n");
+  programs[key] = program;
+  kernels[key] = kernel;
+  return kernel;
+}
+
+// Make a previously created kernel current
+void gpu_handler::use_kernel(cl_kernel _kernel) {
+  kernel = _kernel;
 }
 
 // Set an argument for the kernel
@@ -93,14 +121,27 @@ void gpu_handler::set_arg(cl_uint num, size_t size, const void* value) {
   if(clSetKernelArg(kernel,num,size,value)) Fatal("Cannot set kernel parameter");
 }
 
-// Run the kernel
+// Run the kernel, the kernel must ignore work items past width and height
 void gpu_handler::run_kernel(size_t width, size_t height) {
-  size_t Global[2] = {width, height};
+  // Pad the range up to a whole number of work groups
+  size_t Global[2] = {(width+work_size-1)/work_size*work_size, (height+work_size-1)/work_size*work_size};
   size_t Local[2] = {work_size, work_size};
   if (clEnqueueNDRangeKernel(queue,kernel,2,NULL,Global,Local,0,NULL,NULL)) Fatal("Cannot run kernel\n");
-  // Release kernel and program
-  if (clReleaseKernel(kernel)) Fatal("Cannot release kernel\n");
-  if (clReleaseProgram(program)) Fatal("Cannot release program\n");
+}
+
+// Work group side length
+size_t gpu_handler::get_work_size() {
+  return work_size;
+}
+
+// Largest single buffer the device can allocate
+cl_ulong gpu_handler::get_max_alloc_size() {
+  return max_alloc_size;
+}
+
+// Total device memory
+cl_ulong gpu_handler::get_global_mem_size() {
+  return global_mem_size;
 }
 
 // Read back from device to host
@@ -9,6 +9,8 @@
 
 #include <stdio.h>
 #include <stdarg.h>
+#include <map>
+#include <string>
 
 void Fatal(const char* format, ...);
 
@@ -16,18 +18,27 @@ class gpu_handler {
   private:
     size_t work_size;
     size_t max_n_work_items;
+    cl_ulong max_alloc_size;
+    cl_ulong global_mem_size;
     cl_kernel kernel;
-    cl_program program;
+    // Kernels already built, keyed by name and build options
+    std::map<std::string, cl_kernel> kernels;
+    std::map<std::string, cl_program> programs;
     cl_device_id device_id;
     cl_context context;
     cl_command_queue queue;
   public:
     gpu_handler(size_t _work_size);
+    ~gpu_handler();
     void init_GPU();
     cl_mem create_buffer(cl_mem_flags flags, size_t size, void* host_ptr);
-    void create_kernel(const char* source, const char* name);
+    cl_kernel create_kernel(const char* source, const char* name, const char* options);
+    void use_kernel(cl_kernel _kernel);
     void set_arg(cl_uint num, size_t size, const void* value);
     void run_kernel(size_t width, size_t height);
+    size_t get_work_size();
+    cl_ulong get_max_alloc_size();
+    cl_ulong get_global_mem_size();
     void read_buffer(cl_mem buffer, cl_bool blocking, size_t offset, size_t cb, void* ptr, cl_uint num_events, const cl_event *wait_list, cl_event *event);
 };
 
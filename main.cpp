@@ -1,11 +1,23 @@
 #include <QApplication>
+#include <stdio.h>
+#include <stdlib.h>
+#include <limits.h>
 #include "project_layout.h"
 
 int main(int argc, char* argv[]) {
   // Make application
   QApplication project(argc,argv);
+  // Grid size and spacing, by default the surface covers the same area whatever the size
+  long width = argc > 1 ? atol(argv[1]) : 1024;
+  long height = argc > 2 ? atol(argv[2]) : width;
+  float spacing = argc > 3 ? atof(argv[3]) : 6.144/qMax(width,height);
+  // Grid indices are ints, so the padded obstacle grid has to fit in one
+  if (width < 3 || height < 3 || spacing <= 0 || (long long)(width+2)*(height+2) > INT_MAX) {
+    fprintf(stderr,"Usage: %s [width [height [spacing]]]\n",argv[0]);
+    return 1;
+  }
   // Make and show the widget for the window
-  project_layout window("Ryan Baten Advanced Graphics Project");
+  project_layout window("Ryan Baten Advanced Graphics Project",width,height,spacing);
   window.show();
   // Run application main loop
   return project.exec();
@@ -6,13 +6,13 @@ void projectGL::drawScene() {
   shader_program[shader]->bind();
 
   // Draw mesh 
-  surface_mesh->drawMesh();
+  surface_mesh->drawMesh(2*depth,fov,height()*devicePixelRatio());
 
   // Release Shader
   shader_program[shader]->release();
 }
 
-projectGL::projectGL() {
+projectGL::projectGL(int grid_width, int grid_height, float spacing) {
   // initialize variables
   mode = 0;
   shader = 1;
@@ -20,11 +20,10 @@ projectGL::projectGL() {
   theta = 45;
   phi = 15;
   depth = 4;
-  disturb_x = 512;
-  disturb_y = 512;
+  disturb_x = grid_width/2;
+  disturb_y = grid_height/2;
   // Create the surface
-  surface_mesh = new surfaceMesh(1024,1024,0.006);
-  //surface_mesh = new surfaceMesh(2048,2048,0.003);
+  surface_mesh = new surfaceMesh(grid_width,grid_height,spacing);
   // Set up a timer
   timer.setInterval(5);
   connect(&timer,SIGNAL(timeout()),this,SLOT(tick()));
@@ -59,6 +58,15 @@ void projectGL::initializeGL() {
     program->addShaderFromSourceFile(QOpenGLShader::Vertex, "color.vert");
     program->addShaderFromSourceFile(QOpenGLShader::Fragment, "bw.frag");
   shader_program.push_back(program);
+  // The mesh is fed through generic attributes rather than gl_Vertex
+  for (int i=0; i<shader_program.size(); i++) {
+    shader_program[i]->bindAttributeLocation("xz",surfaceMesh::GRID_ATTRIB);
+    shader_program[i]->bindAttributeLocation("height",surfaceMesh::HEIGHT_ATTRIB);
+    shader_program[i]->link();
+  }
+
+  // Upload the static parts of the mesh
+  surface_mesh->initGL();
 }
 
 // Draw everything
@@ -106,6 +114,15 @@ void projectGL::doModelViewProjection() {
   glRotated(theta,0,1,0);
 }
 
+// Zoom the camera in and out with the mouse wheel
+void projectGL::wheelEvent(QWheelEvent *event) {
+  if (event->angleDelta().y() > 0)
+    depth = qMax(depth/1.1,0.5);
+  else if (event->angleDelta().y() < 0)
+    depth = qMin(depth*1.1,64.0);
+  update();
+}
+
 // Perform update of mesh and screen ever tick
 void projectGL::tick() {
   switch(mode) {
@@ -128,6 +145,8 @@ void projectGL::tick() {
       surface_mesh->heightfieldObstacleDevice();
       break;
   }
+  // Decimate the new heights for rendering
+  surface_mesh->buildPyramid();
   update();
 }
 
@@ -135,6 +154,9 @@ void projectGL::tick() {
 void projectGL::setMode(int _mode) {
   if (mode/2 != _mode/2)
     surface_mesh->reset();
+  // Pick the kernels built for the new mode, odd modes run on the device
+  if (_mode%2)
+    surface_mesh->specialize(_mode >= 4);
   mode = _mode;
 }
 
@@ -143,6 +165,11 @@ void projectGL::setShader(int _shader) {
   shader = _shader;
 }
 
+// Set how the mesh is drawn
+void projectGL::setMeshMode(int _mesh_mode) {
+  surface_mesh->setMeshMode(_mesh_mode);
+}
+
 // For slider value changes
 void projectGL::setX(int _x) {
   disturb_x = _x;
@@ -31,12 +31,14 @@ class projectGL : public QOpenGLWidget, protected QOpenGLFunctions{
     void initializeGL();
     void paintGL();
     void doModelViewProjection();
+    void wheelEvent(QWheelEvent *event);
   public:
-    projectGL();
+    projectGL(int grid_width, int grid_height, float spacing);
     QSize sizeHint() const {return QSize(600,600);}
   public slots:
     void setMode(int _mode);
     void setShader(int _shader);
+    void setMeshMode(int _mesh_mode);
     void setX(int _x);
     void setY(int _y);
     void addDisturbance();
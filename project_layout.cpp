@@ -6,11 +6,11 @@
 #include <QString>
 #include "project_layout.h"
 
-project_layout::project_layout(const char* title) {
+project_layout::project_layout(const char* title, int grid_width, int grid_height, float spacing) {
   // Set the window title to the title specified by the user
   setWindowTitle(QString(title));
   // Create the widget for handling opengl
-  gl_widget = new projectGL;
+  gl_widget = new projectGL(grid_width,grid_height,spacing);
 
   // Select mode
   QComboBox* mode_selector = new QComboBox();
@@ -29,6 +29,11 @@ project_layout::project_layout(const char* title) {
   shader_selector->addItem("Black/White");
   shader_selector->setCurrentIndex(1);
 
+  // Select how the mesh is drawn
+  QComboBox* mesh_selector = new QComboBox();
+  mesh_selector->addItem("Points");
+  mesh_selector->addItem("LOD Mesh");
+
   // Buttons
   QPushButton* disturb = new QPushButton("Add Disturbance");
   QPushButton* reset = new QPushButton("Reset");
@@ -37,36 +42,39 @@ project_layout::project_layout(const char* title) {
   // Sliders
   QSlider* x = new QSlider(Qt::Horizontal);
   x->setMinimum(2);
-  x->setMaximum(1022);
-  x->setValue(512);
+  x->setMaximum(grid_width-2);
+  x->setValue(grid_width/2);
   QSlider* y = new QSlider(Qt::Horizontal);
   y->setMinimum(2);
-  y->setMaximum(1022);
-  y->setValue(512);
+  y->setMaximum(grid_height-2);
+  y->setValue(grid_height/2);
 
   // Set the layout
   layout = new QGridLayout;
-  layout->addWidget(gl_widget,0,0,8,1);
+  layout->addWidget(gl_widget,0,0,9,1);
   layout->addWidget(new QLabel("Mode"),0,1);
   layout->addWidget(mode_selector,0,2);
   layout->addWidget(new QLabel("Shader"),1,1);
   layout->addWidget(shader_selector,1,2);
-  layout->addWidget(new QLabel("X"),2,1);
-  layout->addWidget(x,2,2);
-  layout->addWidget(new QLabel("Y"),3,1);
-  layout->addWidget(y,3,2);
-  layout->addWidget(disturb,4,2);
-  layout->addWidget(reset,5,1);
-  layout->addWidget(quit,7,2);
+  layout->addWidget(new QLabel("Render"),2,1);
+  layout->addWidget(mesh_selector,2,2);
+  layout->addWidget(new QLabel("X"),3,1);
+  layout->addWidget(x,3,2);
+  layout->addWidget(new QLabel("Y"),4,1);
+  layout->addWidget(y,4,2);
+  layout->addWidget(disturb,5,2);
+  layout->addWidget(reset,6,1);
+  layout->addWidget(quit,8,2);
   // Resizing options
   layout->setColumnStretch(0,100);
   layout->setColumnMinimumWidth(0,100);
-  layout->setRowStretch(3,100);
+  layout->setRowStretch(4,100);
   setLayout(layout);
 
   // Connect signals to gl_widget
   connect(mode_selector, SIGNAL(currentIndexChanged(int)), gl_widget, SLOT(setMode(int)));
   connect(shader_selector, SIGNAL(currentIndexChanged(int)), gl_widget, SLOT(setShader(int)));
+  connect(mesh_selector, SIGNAL(currentIndexChanged(int)), gl_widget, SLOT(setMeshMode(int)));
   connect(x, SIGNAL(valueChanged(int)), gl_widget, SLOT(setX(int)));
   connect(y, SIGNAL(valueChanged(int)), gl_widget, SLOT(setY(int)));
   connect(disturb, SIGNAL(pressed()), gl_widget, SLOT(addDisturbance()));
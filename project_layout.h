@@ -12,7 +12,7 @@ class project_layout : public QWidget {
     projectGL *gl_widget;
     QGridLayout *layout;
   public:
-    project_layout(const char* title);
+    project_layout(const char* title, int grid_width, int grid_height, float spacing);
 };
 
 #endif
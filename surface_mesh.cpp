@@ -1,6 +1,17 @@
 #include "surface_mesh.h"
 #include <math.h>
 
+// Smallest side a decimated level may have
+const int lod_min_size = 8;
+// Size in pixels a mesh cell should cover on screen
+const double lod_pixels_per_cell = 1;
+// Most cells a level may have to get vertex buffers
+const int lod_max_cells = 4096*4096;
+// Fraction of device memory the simulation may use
+const double device_mem_fraction = 0.5;
+// Fraction of the heightfield velocity kept each step
+const double damping = 0.998;
+
 // Initialize a mesh of w*h points separated by a spacing amount
 surfaceMesh::surfaceMesh(int w, int h, float s) {
   mesh_mode = 0;
@@ -8,42 +19,178 @@ surfaceMesh::surfaceMesh(int w, int h, float s) {
   height = h;
   spacing = s;
   gpu = new gpu_handler(32);
-  mesh = new float[width*height*4];
+  height_vbo = 0;
+  lod_level = 0;
+  // Only the heights are kept on the host, the x/z grid lives in a vertex buffer
+  mesh = new float[width*height];
+  // Each level keeps every other point of the one above it, including the last row and column
+  level_width.push_back(width);
+  level_height.push_back(height);
+  level_mesh.push_back(mesh);
+  while (level_width.back()/2+1 >= lod_min_size && level_height.back()/2+1 >= lod_min_size) {
+    int w = level_width.back()/2+1;
+    int h = level_height.back()/2+1;
+    level_width.push_back(w);
+    level_height.push_back(h);
+    level_mesh.push_back(new float[w*h]);
+  }
   heightf = new float[width*height];
-  obstacle = new int[(width+2)*(height+2)];
-  // Fill mesh with equally spaced points, spaced by a certain amount
+  obstacle = new unsigned char[(width+2)*(height+2)];
+  // Obstacle rows are padded with a wall on either side
+  int ow = width+2;
+  // Start with a flat mesh
   for (int j=0; j<height; j++) {
     for (int i=0; i<width; i++) {
-      mesh[4*(j*width+i)] = i*spacing - height*spacing/2;
-      mesh[4*(j*width+i)+1] = 0;
-      mesh[4*(j*width+i)+2] = j*spacing - width*spacing/2;
-      mesh[4*(j*width+i)+3] = 1;
+      mesh[j*width+i] = 0;
       heightf[j*width+i] = 0;
-      if (abs(i-width/2) < width/6 && abs(j-height/2) < height/6) 
-         obstacle[(j+1)*width+i+1] = 1;
+      obstacle[(j+1)*ow+i+1] = abs(i-width/2) < width/6 && abs(j-height/2) < height/6;
     }
   }
   // Make the walls part of obstacle
   for (int j=0; j<height+2; j++) {
-    obstacle[j*width] = 1;
-    obstacle[j*width+width+1] = 1;
+    obstacle[j*ow] = 1;
+    obstacle[j*ow+width+1] = 1;
   }
   for (int i=0; i<width+2; i++) {
     obstacle[i] = 1;
-    obstacle[(height+1)*width+i] = 1;
+    obstacle[(height+1)*ow+i] = 1;
   }
+  planMemory();
+  // Specialize the host steps and kernels for this grid
+  host_heightfield[0] = pickHeightfieldStep<false>();
+  host_heightfield[1] = pickHeightfieldStep<true>();
+  kernel_options[0] = kernelOptions(false);
+  kernel_options[1] = kernelOptions(true);
+  // Kernels are built the first time a device mode is picked
+  obstacles = false;
+  procedural_kernel = NULL;
+  heightfield_kernel = NULL;
+}
+
+// Work out how the grid is split up to fit in device memory and which levels can be drawn
+void surfaceMesh::planMemory() {
+  size_t row_bytes = width*sizeof(float);
+  size_t obstacle_row_bytes = (width+2)*sizeof(unsigned char);
+  // Host memory for the mesh, heightfield, obstacles and decimated levels
+  size_t host_bytes = 2*height*row_bytes + (height+2)*obstacle_row_bytes;
+  for (int l=1; l<level_mesh.size(); l++)
+    host_bytes += (size_t)level_width[l]*level_height[l]*sizeof(float);
+  // Obstacle mode is the largest, a band of rows needs its mesh and obstacles one row either side
+  size_t band_bytes = 2*row_bytes + obstacle_row_bytes;
+  size_t halo_bytes = 2*row_bytes + 2*obstacle_row_bytes;
+  size_t device_bytes = height*band_bytes + halo_bytes;
+  // Largest band whose buffers each fit in one allocation and together fit in the budget
+  size_t budget = gpu->get_global_mem_size()*device_mem_fraction;
+  size_t max_alloc = gpu->get_max_alloc_size();
+  if (budget < halo_bytes + band_bytes || max_alloc < 3*row_bytes)
+    Fatal("A %d wide grid does not fit in device memory\n",width);
+  size_t max_rows = qMin(max_alloc/row_bytes - 2, (budget - halo_bytes)/band_bytes);
+  chunk_rows = qMin((size_t)height, max_rows);
+  // Keep bands a whole number of work groups high
+  size_t work_size = gpu->get_work_size();
+  if (chunk_rows < height && chunk_rows > (int)work_size)
+    chunk_rows -= chunk_rows%work_size;
+  int n_chunks = (height+chunk_rows-1)/chunk_rows;
+  // Finest level small enough to keep in vertex buffers
+  min_render_level = 0;
+  while (min_render_level < level_mesh.size()-1 && (level_width[min_render_level]-1)*(level_height[min_render_level]-1) > lod_max_cells)
+    min_render_level++;
+  lod_level = min_render_level;
+  printf("Grid %dx%d: %.1f MB host, %.1f MB device in %d band(s) of %d rows, drawing from %dx%d\n",
+         width,height,host_bytes/1048576.0,device_bytes/1048576.0,n_chunks,chunk_rows,
+         level_width[min_render_level],level_height[min_render_level]);
 }
 
 surfaceMesh::~surfaceMesh() {
-  delete mesh;
-  delete heightf;
+  for (int l=0; l<level_mesh.size(); l++)
+    delete[] level_mesh[l];
+  delete[] heightf;
+  delete[] obstacle;
+  delete gpu;
+}
+
+// Create the vertex buffers, must be called with the GL context current
+void surfaceMesh::initGL() {
+  initializeOpenGLFunctions();
+  // Replace any buffers left from an earlier initialization
+  for (int l=0; l<level_grid_vbo.size(); l++) {
+    if (level_grid_vbo[l]) glDeleteBuffers(1,&level_grid_vbo[l]);
+    if (level_index_vbo[l]) glDeleteBuffers(1,&level_index_vbo[l]);
+  }
+  level_grid_vbo.clear();
+  level_index_vbo.clear();
+  level_n_indices.clear();
+  if (height_vbo) glDeleteBuffers(1,&height_vbo);
+  // Columns and rows of the full mesh that each level samples
+  QVector<int> cols, rows;
+  for (int i=0; i<width; i++) cols.push_back(i);
+  for (int j=0; j<height; j++) rows.push_back(j);
+  for (int l=0; l<level_mesh.size(); l++) {
+    int w = level_width[l];
+    int h = level_height[l];
+    if (l > 0) {
+      QVector<int> parent_cols = cols, parent_rows = rows;
+      cols.clear();
+      rows.clear();
+      for (int i=0; i<w; i++) cols.push_back(parent_cols[qMin(2*i,parent_cols.size()-1)]);
+      for (int j=0; j<h; j++) rows.push_back(parent_rows[qMin(2*j,parent_rows.size()-1)]);
+    }
+    // Levels too large to draw get no buffers
+    if (l < min_render_level) {
+      level_grid_vbo.push_back(0);
+      level_index_vbo.push_back(0);
+      level_n_indices.push_back(0);
+      continue;
+    }
+    // Fill the grid with equally spaced x/z points, spaced by a certain amount
+    float *grid = new float[w*h*2];
+    for (int j=0; j<h; j++) {
+      for (int i=0; i<w; i++) {
+        grid[2*(j*w+i)] = cols[i]*spacing - width*spacing/2;
+        grid[2*(j*w+i)+1] = rows[j]*spacing - height*spacing/2;
+      }
+    }
+    // The grid never changes so it is uploaded once
+    GLuint vbo;
+    glGenBuffers(1,&vbo);
+    glBindBuffer(GL_ARRAY_BUFFER,vbo);
+    glBufferData(GL_ARRAY_BUFFER,(size_t)w*h*2*sizeof(float),grid,GL_STATIC_DRAW);
+    level_grid_vbo.push_back(vbo);
+    delete[] grid;
+    // One triangle strip per pair of rows, stitched together with degenerate triangles
+    int n_indices = (h-1)*2*w + (h-2)*2;
+    GLuint *indices = new GLuint[n_indices];
+    int k = 0;
+    for (int j=0; j<h-1; j++) {
+      if (j > 0) {
+        indices[k++] = j*w+w-1;
+        indices[k++] = j*w;
+      }
+      for (int i=0; i<w; i++) {
+        indices[k++] = j*w+i;
+        indices[k++] = (j+1)*w+i;
+      }
+    }
+    glGenBuffers(1,&vbo);
+    glBindBuffer(GL_ELEMENT_ARRAY_BUFFER,vbo);
+    glBufferData(GL_ELEMENT_ARRAY_BUFFER,n_indices*sizeof(GLuint),indices,GL_STATIC_DRAW);
+    level_index_vbo.push_back(vbo);
+    level_n_indices.push_back(n_indices);
+    delete[] indices;
+  }
+  glBindBuffer(GL_ELEMENT_ARRAY_BUFFER,0);
+  // The heights are streamed in every frame
+  glGenBuffers(1,&height_vbo);
+  glBindBuffer(GL_ARRAY_BUFFER,height_vbo);
+  glBufferData(GL_ARRAY_BUFFER,(size_t)level_width[min_render_level]*level_height[min_render_level]*sizeof(float),NULL,GL_STREAM_DRAW);
+  glBindBuffer(GL_ARRAY_BUFFER,0);
 }
 
 // Resets the mesh
 void surfaceMesh::reset() {
   for (int j=0; j<height; j++) {
     for (int i=0; i<width; i++) {
-      mesh[4*(j*width+i)+1] = 0;
+      mesh[j*width+i] = 0;
       heightf[j*width+i] = 0;
     }
   }
@@ -54,113 +201,176 @@ void surfaceMesh::procedural(float time) {
   // Vary the height of the points using overlapping sine waves of differing wavelengths
   for (int j=0; j<height; j++) {
     for (int i=0; i<width; i++) {
-      mesh[4*(j*width+i)+1] = 0.1*sin(0.01*time+i*spacing)+0.15*sin(0.02*time+j*spacing)+0.2*sin(0.03*time+(i+j)*spacing);
+      mesh[j*width+i] = 0.1*sin(0.01*time+i*spacing)+0.15*sin(0.02*time+j*spacing)+0.2*sin(0.03*time+(i+j)*spacing);
     }
   }
 }
 
+// Kernels are built with WIDTH, HEIGHT, SPACING, DAMPING and HAS_OBSTACLE defined for the grid
 const char* procedural_source = 
-  "__kernel void procedural(float time, float spacing, int width, __global float mesh[])\n"
+  "__kernel void procedural(float time, int row, int rows, __global float mesh[])\n"
   "{\n"
-  "  unsigned int i = get_global_id(0);\n"
-  "  unsigned int j = get_global_id(1);\n"
-  "  mesh[4*(j*width+i)+1] = 0.1*sin(0.01*time+i*spacing)+0.15*sin(0.02*time+j*spacing)+0.2*sin(0.03*time+(i+j)*spacing);\n"
+  "  int i = get_global_id(0);\n"
+  "  int j = get_global_id(1);\n"
+  "  if (i >= WIDTH || j >= rows) return;\n"
+  "  int gj = row+j;\n"
+  "  mesh[j*WIDTH+i] = 0.1*sin(0.01*time+i*SPACING)+0.15*sin(0.02*time+gj*SPACING)+0.2*sin(0.03*time+(i+gj)*SPACING);\n"
   "}\n";
 
 // Procedural wave generation on the gpu
 void surfaceMesh::proceduralDevice(float time) {
-  // Size of mesh
-  unsigned int N = width*height*4*sizeof(float);
-  // Allocate space on device
-  cl_mem mesh_d = gpu->create_buffer(CL_MEM_READ_WRITE|CL_MEM_COPY_HOST_PTR,N,mesh);
-  // Create kernel
-  gpu->create_kernel(procedural_source,"procedural");
-  // Set arguments
-  gpu->set_arg(0,sizeof(float),&time);
-  gpu->set_arg(1,sizeof(float),&spacing);
-  gpu->set_arg(2,sizeof(int),&width);
-  gpu->set_arg(3,sizeof(cl_mem),&mesh_d);
-  // Run the kernel
-  gpu->run_kernel(width,height);
-  // Read back results
-  gpu->read_buffer(mesh_d,CL_TRUE,0,N,mesh,0,NULL,NULL);
-  // Free device memory
-  clReleaseMemObject(mesh_d);
+  if (!procedural_kernel) specialize(obstacles);
+  gpu->use_kernel(procedural_kernel);
+  for (int row=0; row<height; row+=chunk_rows) {
+    int rows = qMin(chunk_rows,height-row);
+    // Size of band
+    size_t N = (size_t)rows*width*sizeof(float);
+    // Allocate space on device
+    cl_mem mesh_d = gpu->create_buffer(CL_MEM_WRITE_ONLY,N,NULL);
+    // Set arguments
+    gpu->set_arg(0,sizeof(float),&time);
+    gpu->set_arg(1,sizeof(int),&row);
+    gpu->set_arg(2,sizeof(int),&rows);
+    gpu->set_arg(3,sizeof(cl_mem),&mesh_d);
+    // Run the kernel
+    gpu->run_kernel(width,rows);
+    // Read back results
+    gpu->read_buffer(mesh_d,CL_TRUE,0,N,mesh+(size_t)row*width,0,NULL,NULL);
+    // Free device memory
+    clReleaseMemObject(mesh_d);
+  }
 }
 
 // Heightfield approximations on the cpu
 // This is the helloworld algorithm outlined in https://www.cs.ubc.ca/~rbridson/fluidsimulation/fluids_notes.pdf
 // I plan to update this to be the full example
-void surfaceMesh::heightfield() {
+// W is the grid width when it is one of the specialized sizes and 0 otherwise
+template<int W, bool Obstacles>
+void surfaceMesh::heightfieldStep() {
+  const int w = W ? W : width;
+  // Obstacle rows are padded with a wall on either side
+  const int ow = w+2;
   int li, lj, hi, hj;
   for (int j=0; j<height; j++) {
-    for (int i=0; i<width; i++) {
-      li = i==0 ? 1 : i;
-      hi = i==width-1 ? width-2 : i;
-      lj = j==0 ? 1 : j;
-      hj = j==height-1 ? height-2 : j;
-      heightf[j*width+i] += (mesh[4*(j*width+(li-1))+1] + mesh[4*(j*width+(hi+1))+1] + mesh[4*((lj-1)*width+i)+1] + mesh[4*((hj+1)*width+i)+1])/4 - mesh[4*(j*width+i)+1];
-      heightf[j*width+i] *= 0.998;
+    for (int i=0; i<w; i++) {
+      if (Obstacles) {
+        // Neighbours that are obstacles reflect back the point itself
+        if (obstacle[(j+1)*ow+i+1]) continue;
+        li = obstacle[(j+1)*ow+i] ? i : i-1;
+        hi = obstacle[(j+1)*ow+i+2] ? i : i+1;
+        lj = obstacle[(j)*ow+i+1] ? j : j-1;
+        hj = obstacle[(j+2)*ow+i+1] ? j : j+1;
+      } else {
+        // The edges of the grid reflect back the point itself
+        li = i==0 ? 0 : i-1;
+        hi = i==w-1 ? i : i+1;
+        lj = j==0 ? 0 : j-1;
+        hj = j==height-1 ? j : j+1;
+      }
+      heightf[j*w+i] += (mesh[j*w+li] + mesh[j*w+hi] + mesh[lj*w+i] + mesh[hj*w+i])/4 - mesh[j*w+i];
+      heightf[j*w+i] *= damping;
     }
   }
   for (int j=0; j<height; j++) {
-    for (int i=0; i<width; i++) {
-      mesh[4*(j*width+i)+1] += heightf[j*width+i];
+    for (int i=0; i<w; i++) {
+      mesh[j*w+i] += heightf[j*w+i];
     }
   }
 }
 
-const char* heightfield_p1_source = 
-  "__kernel void heightfield_p1(int width, int height, __global float mesh[], __global float heightf[])\n"
+// Pick the host heightfield step for the grid width
+template<bool Obstacles>
+surfaceMesh::stepFunction surfaceMesh::pickHeightfieldStep() {
+  switch (width) {
+    case 512:  return &surfaceMesh::heightfieldStep<512,Obstacles>;
+    case 1024: return &surfaceMesh::heightfieldStep<1024,Obstacles>;
+    case 2048: return &surfaceMesh::heightfieldStep<2048,Obstacles>;
+    case 4096: return &surfaceMesh::heightfieldStep<4096,Obstacles>;
+    default:   return &surfaceMesh::heightfieldStep<0,Obstacles>;
+  }
+}
+
+void surfaceMesh::heightfield() {
+  (this->*host_heightfield[0])();
+}
+
+const char* heightfield_source = 
+  "#if HAS_OBSTACLE\n"
+  "__kernel void heightfield(int row, int rows, int mesh_row, __global const float mesh[], __global float heightf[], __global const uchar obstacle[])\n"
+  "#else\n"
+  "__kernel void heightfield(int row, int rows, int mesh_row, __global const float mesh[], __global float heightf[])\n"
+  "#endif\n"
   "{\n"
   "  int i = get_global_id(0);\n"
   "  int j = get_global_id(1);\n"
-  "  int li = max(1,i);\n"
-  "  int hi = min(width-2,i);\n"
-  "  int lj = max(1,j);\n"
-  "  int hj = min(height-2,j);\n"
-  "  heightf[j*width+i] += (mesh[4*(j*width+(li-1))+1] + mesh[4*(j*width+(hi+1))+1] + mesh[4*((lj-1)*width+i)+1] + mesh[4*((hj+1)*width+i)+1])/4 - mesh[4*(j*width+i)+1];\n"
-  "  heightf[j*width+i] *= 0.998;\n"
-  "}\n";
-
-const char* heightfield_p2_source = 
-  "__kernel void heightfield_p2(int width, __global float mesh[], __global float heightf[])\n"
-  "{\n"
-  "  unsigned int j = get_global_id(0);\n"
-  "  unsigned int i = get_global_id(1);\n"
-  "  mesh[4*(j*width+i)+1] += heightf[j*width+i];\n"
+  "  if (i >= WIDTH || j >= rows) return;\n"
+  "  int gj = row+j;\n"
+  "#if HAS_OBSTACLE\n"
+  "  int ow = WIDTH+2;\n"
+  "  int li = obstacle[(j+1)*ow+i] ? i : i-1;\n"
+  "  int hi = obstacle[(j+1)*ow+i+2] ? i : i+1;\n"
+  "  int lj = obstacle[(j)*ow+i+1] ? gj : gj-1;\n"
+  "  int hj = obstacle[(j+2)*ow+i+1] ? gj : gj+1;\n"
+  "  float wet = 1-obstacle[(j+1)*ow+i+1];\n"
+  "#else\n"
+  "  int li = max(i-1,0);\n"
+  "  int hi = min(i+1,WIDTH-1);\n"
+  "  int lj = max(gj-1,0);\n"
+  "  int hj = min(gj+1,HEIGHT-1);\n"
+  "  float wet = 1;\n"
+  "#endif\n"
+  "  heightf[j*WIDTH+i] += ((mesh[(gj-mesh_row)*WIDTH+li] + mesh[(gj-mesh_row)*WIDTH+hi] + mesh[(lj-mesh_row)*WIDTH+i] + mesh[(hj-mesh_row)*WIDTH+i])/4 - mesh[(gj-mesh_row)*WIDTH+i]) * wet;\n"
+  "  heightf[j*WIDTH+i] *= DAMPING;\n"
   "}\n";
- 
 
-// Heightfield approximations on the gpu
-void surfaceMesh::heightfieldDevice() {
-  // Size of mesh
-  unsigned int N = width*height*4*sizeof(float);
-  // Size of buffer for heightfield
-  unsigned int M = width*height*sizeof(float);
-  // Allocate space on device
-  cl_mem mesh_d = gpu->create_buffer(CL_MEM_READ_WRITE|CL_MEM_COPY_HOST_PTR,N,mesh);
-  cl_mem heightf_d = gpu->create_buffer(CL_MEM_READ_WRITE|CL_MEM_COPY_HOST_PTR,M,heightf);
-  // Create kernel p1
-  gpu->create_kernel(heightfield_p1_source, "heightfield_p1");
-  // Arguments to part 1
-  gpu->set_arg(0,sizeof(int),&width);
-  gpu->set_arg(1,sizeof(int),&height);
-  gpu->set_arg(2,sizeof(cl_mem),&mesh_d);
-  gpu->set_arg(3,sizeof(cl_mem),&heightf_d);
-  // Run kernel
-  gpu->run_kernel(width,height);
-  // Read back results
-  gpu->read_buffer(heightf_d,CL_TRUE,0,M,heightf,0,NULL,NULL);
+// Heightfield approximations on the gpu, one band of rows at a time
+void surfaceMesh::heightfieldBands(bool with_obstacles) {
+  if (!heightfield_kernel || with_obstacles != obstacles) specialize(with_obstacles);
+  gpu->use_kernel(heightfield_kernel);
+  for (int row=0; row<height; row+=chunk_rows) {
+    int rows = qMin(chunk_rows,height-row);
+    // The band reads one row of the mesh above and below itself
+    int mesh_row = qMax(row-1,0);
+    int mesh_rows = qMin(row+rows+1,height) - mesh_row;
+    // Size of mesh band
+    size_t N = (size_t)mesh_rows*width*sizeof(float);
+    // Size of buffer for heightfield band
+    size_t M = (size_t)rows*width*sizeof(float);
+    // Size of buffer for obstacle band, including the padded rows on either side
+    size_t O = (size_t)(rows+2)*(width+2)*sizeof(unsigned char);
+    // Allocate space on device
+    cl_mem mesh_d = gpu->create_buffer(CL_MEM_READ_ONLY|CL_MEM_COPY_HOST_PTR,N,mesh+(size_t)mesh_row*width);
+    cl_mem heightf_d = gpu->create_buffer(CL_MEM_READ_WRITE|CL_MEM_COPY_HOST_PTR,M,heightf+(size_t)row*width);
+    cl_mem obstacle_d = NULL;
+    // Arguments
+    gpu->set_arg(0,sizeof(int),&row);
+    gpu->set_arg(1,sizeof(int),&rows);
+    gpu->set_arg(2,sizeof(int),&mesh_row);
+    gpu->set_arg(3,sizeof(cl_mem),&mesh_d);
+    gpu->set_arg(4,sizeof(cl_mem),&heightf_d);
+    if (obstacles) {
+      obstacle_d = gpu->create_buffer(CL_MEM_READ_ONLY|CL_MEM_COPY_HOST_PTR,O,obstacle+(size_t)row*(width+2));
+      gpu->set_arg(5,sizeof(cl_mem),&obstacle_d);
+    }
+    // Run kernel
+    gpu->run_kernel(width,rows);
+    // Read back results
+    gpu->read_buffer(heightf_d,CL_TRUE,0,M,heightf+(size_t)row*width,0,NULL,NULL);
+    // Free memory
+    clReleaseMemObject(mesh_d);
+    clReleaseMemObject(heightf_d);
+    if (obstacle_d) clReleaseMemObject(obstacle_d);
+  }
   // Add in the heights
   for (int j=0; j<height; j++) {
     for (int i=0; i<width; i++) {
-      mesh[4*(j*width+i)+1] += heightf[j*width+i];
+      mesh[j*width+i] += heightf[j*width+i];
     }
   }
-  // Free memory
-  clReleaseMemObject(mesh_d);
-  clReleaseMemObject(heightf_d);
+}
+
+void surfaceMesh::heightfieldDevice() {
+  heightfieldBands(false);
 }
 
 // Add some disturbance when using heightfield
@@ -168,83 +378,96 @@ void surfaceMesh::addHFRipple(int x, int y) {
   heightf[y*width+x] += 20;
 }
 
-
 void surfaceMesh::heightfieldObstacle() {
-  int li, lj, hi, hj;
-  for (int j=0; j<height; j++) {
-    for (int i=0; i<width; i++) {
-      li = obstacle[(j+1)*width+i] ? i : i-1;
-      hi = obstacle[(j+1)*width+i+2] ? i : i+1;
-      lj = obstacle[(j)*width+i+1] ? j : j-1;
-      hj = obstacle[(j+2)*width+i+1] ? j : j+1;
-      if (!obstacle[(j+1)*width+i+1]) {
-        heightf[j*width+i] += (mesh[4*(j*width+li)+1] + mesh[4*(j*width+hi)+1] + mesh[4*(lj*width+i)+1] + mesh[4*(hj*width+i)+1])/4 - mesh[4*(j*width+i)+1];
-        heightf[j*width+i] *= 0.998;
-      }
-    }
-  }
-  for (int j=0; j<height; j++) {
-    for (int i=0; i<width; i++) {
-      mesh[4*(j*width+i)+1] += heightf[j*width+i];
-    }
-  }
+  (this->*host_heightfield[1])();
 }
-const char* heightfield_obstacle_source = 
-  "__kernel void heightfield_obs(int width, int height, __global float mesh[], __global float heightf[], __global int obstacle[])\n"
-  "{\n"
-  "  int i = get_global_id(0);\n"
-  "  int j = get_global_id(1);\n"
-  "  int li = obstacle[(j+1)*width+i] ? i : i-1;\n"
-  "  int hi = obstacle[(j+1)*width+i+2] ? i : i+1;\n"
-  "  int lj = obstacle[(j)*width+i+1] ? j : j-1;\n"
-  "  int hj = obstacle[(j+2)*width+i+1] ? j : j+1;\n"
-  "  heightf[j*width+i] += ((mesh[4*(j*width+li)+1] + mesh[4*(j*width+hi)+1] + mesh[4*(lj*width+i)+1] + mesh[4*(hj*width+i)+1])/4 - mesh[4*(j*width+i)+1]) * (1-obstacle[(j+1)*width+i+1]);\n"
-  "  heightf[j*width+i] *= 0.998;\n"
-  "}\n";
 
 void surfaceMesh::heightfieldObstacleDevice() {
-  // Size of mesh
-  unsigned int N = width*height*4*sizeof(float);
-  // Size of buffer for heightfield
-  unsigned int M = width*height*sizeof(float);
-  // Size of buffer for obstacle
-  unsigned int O = (width+2)*(height+2)*sizeof(int);
-  // Allocate space on device
-  cl_mem mesh_d = gpu->create_buffer(CL_MEM_READ_WRITE|CL_MEM_COPY_HOST_PTR,N,mesh);
-  cl_mem heightf_d = gpu->create_buffer(CL_MEM_READ_WRITE|CL_MEM_COPY_HOST_PTR,M,heightf);
-  cl_mem obstacle_d = gpu->create_buffer(CL_MEM_READ_ONLY|CL_MEM_COPY_HOST_PTR,O,obstacle);
-  // Create kernel p1
-  gpu->create_kernel(heightfield_obstacle_source, "heightfield_obs");
-  // Arguments to part 1
-  gpu->set_arg(0,sizeof(int),&width);
-  gpu->set_arg(1,sizeof(int),&height);
-  gpu->set_arg(2,sizeof(cl_mem),&mesh_d);
-  gpu->set_arg(3,sizeof(cl_mem),&heightf_d);
-  gpu->set_arg(4,sizeof(cl_mem),&obstacle_d);
-  // Run kernel
-  gpu->run_kernel(width,height);
-  // Read back results
-  gpu->read_buffer(heightf_d,CL_TRUE,0,M,heightf,0,NULL,NULL);
-  // Add in the heights
-  for (int j=0; j<height; j++) {
-    for (int i=0; i<width; i++) {
-      mesh[4*(j*width+i)+1] += heightf[j*width+i];
+  heightfieldBands(true);
+}
+
+// Build options fixing the grid constants in the kernels
+std::string surfaceMesh::kernelOptions(bool with_obstacles) {
+  char options[256];
+  snprintf(options,sizeof(options),"-DWIDTH=%d -DHEIGHT=%d -DSPACING=%.9g -DDAMPING=%.9g -DHAS_OBSTACLE=%d",
+           width,height,spacing,damping,with_obstacles);
+  return std::string(options);
+}
+
+// Pick the kernels for the grid with or without obstacles, each variant is built the first time it is used
+void surfaceMesh::specialize(bool with_obstacles) {
+  obstacles = with_obstacles;
+  procedural_kernel = gpu->create_kernel(procedural_source,"procedural",kernel_options[0].c_str());
+  heightfield_kernel = gpu->create_kernel(heightfield_source,"heightfield",kernel_options[obstacles].c_str());
+}
+
+// Decimate the heights down to the level that will be drawn, run after every simulation step
+void surfaceMesh::buildPyramid() {
+  for (int l=1; l<=lod_level; l++) {
+    int pw = level_width[l-1];
+    int ph = level_height[l-1];
+    int w = level_width[l];
+    int h = level_height[l];
+    float *parent = level_mesh[l-1];
+    float *child = level_mesh[l];
+    // 3x3 tent filter centered on the parent point each child point sits on
+    for (int j=0; j<h; j++) {
+      int cj = qMin(2*j,ph-1);
+      int lj = qMax(cj-1,0);
+      int hj = qMin(cj+1,ph-1);
+      for (int i=0; i<w; i++) {
+        int ci = qMin(2*i,pw-1);
+        int li = qMax(ci-1,0);
+        int hi = qMin(ci+1,pw-1);
+        child[j*w+i] = (4*parent[cj*pw+ci]
+                     + 2*(parent[cj*pw+li] + parent[cj*pw+hi] + parent[lj*pw+ci] + parent[hj*pw+ci])
+                     + parent[lj*pw+li] + parent[lj*pw+hi] + parent[hj*pw+li] + parent[hj*pw+hi])/16;
+      }
     }
   }
-  // Free memory
-  clReleaseMemObject(mesh_d);
-  clReleaseMemObject(heightf_d);
-  clReleaseMemObject(obstacle_d);
 }
 
-void surfaceMesh::drawMesh() {
-  glEnableClientState(GL_VERTEX_ARRAY);
-  glVertexPointer(4,GL_FLOAT,0,mesh);
-  // Draw mesh
-  glDrawArrays(GL_POINTS,0,width*height);
-  glDisableClientState(GL_VERTEX_ARRAY);
+// Orphan last frame's heights so the driver doesn't stall on them, then stream the new ones
+void surfaceMesh::streamHeights(int level) {
+  size_t N = (size_t)level_width[level]*level_height[level]*sizeof(float);
+  glBindBuffer(GL_ARRAY_BUFFER,height_vbo);
+  glBufferData(GL_ARRAY_BUFFER,N,NULL,GL_STREAM_DRAW);
+  glBufferSubData(GL_ARRAY_BUFFER,0,N,level_mesh[level]);
+  glVertexAttribPointer(HEIGHT_ATTRIB,1,GL_FLOAT,GL_FALSE,0,0);
+  glEnableVertexAttribArray(HEIGHT_ATTRIB);
+  // Static x/z grid
+  glBindBuffer(GL_ARRAY_BUFFER,level_grid_vbo[level]);
+  glVertexAttribPointer(GRID_ATTRIB,2,GL_FLOAT,GL_FALSE,0,0);
+  glEnableVertexAttribArray(GRID_ATTRIB);
+}
+
+// Draw the mesh as seen from distance away with a vertical fov in degrees
+void surfaceMesh::drawMesh(double distance, double fov, int viewport_height) {
+  if (mesh_mode == 0) {
+    // Every point of the finest level that can be drawn
+    lod_level = min_render_level;
+    streamHeights(lod_level);
+    glDrawArrays(GL_POINTS,0,level_width[lod_level]*level_height[lod_level]);
+  } else {
+    // Pick the coarsest level whose cells still cover about lod_pixels_per_cell on screen
+    double cell_pixels = spacing*viewport_height/(2*distance*tan(fov*M_PI/360));
+    int built_level = lod_level;
+    lod_level = min_render_level;
+    while (lod_level < level_mesh.size()-1 && (2 << lod_level)*cell_pixels <= lod_pixels_per_cell)
+      lod_level++;
+    // Zoomed out since the last step, the coarser levels haven't been built yet
+    if (lod_level > built_level) buildPyramid();
+    streamHeights(lod_level);
+    glBindBuffer(GL_ELEMENT_ARRAY_BUFFER,level_index_vbo[lod_level]);
+    glDrawElements(GL_TRIANGLE_STRIP,level_n_indices[lod_level],GL_UNSIGNED_INT,0);
+    glBindBuffer(GL_ELEMENT_ARRAY_BUFFER,0);
+  }
+  glDisableVertexAttribArray(GRID_ATTRIB);
+  glDisableVertexAttribArray(HEIGHT_ATTRIB);
+  glBindBuffer(GL_ARRAY_BUFFER,0);
 }
 
-void surfaceMesh::toggleMeshMode() {
-  mesh_mode = !mesh_mode;
+// 0 draws every point, 1 draws a decimated triangle mesh
+void surfaceMesh::setMeshMode(int _mesh_mode) {
+  mesh_mode = _mesh_mode;
 }
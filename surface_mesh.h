@@ -2,21 +2,52 @@
 #define SURFACE_MESH_H
 
 #include <QtOpenGL>
+#include <QOpenGLFunctions>
+#include <QVector>
+#include <string>
 #include "gpu_handler.h"
 
-class surfaceMesh {
+class surfaceMesh : protected QOpenGLFunctions {
   private:
     int mesh_mode;
     int width;
     int height;
     float spacing;
-    int *obstacle;
+    unsigned char *obstacle;
     float *mesh;
     float *heightf;
+    GLuint height_vbo;
+    // Level of detail pyramid, level 0 is the full mesh and each level halves the resolution
+    int lod_level;
+    int min_render_level;
+    QVector<int> level_width;
+    QVector<int> level_height;
+    QVector<float*> level_mesh;
+    QVector<GLuint> level_grid_vbo;
+    QVector<GLuint> level_index_vbo;
+    QVector<int> level_n_indices;
     gpu_handler *gpu;
+    // Rows of the grid the device works on at a time
+    int chunk_rows;
+    void planMemory();
+    // Kernels and host steps specialized for the grid
+    typedef void (surfaceMesh::*stepFunction)();
+    stepFunction host_heightfield[2];
+    std::string kernel_options[2];
+    bool obstacles;
+    cl_kernel procedural_kernel;
+    cl_kernel heightfield_kernel;
+    template<int W, bool Obstacles> void heightfieldStep();
+    template<bool Obstacles> stepFunction pickHeightfieldStep();
+    std::string kernelOptions(bool with_obstacles);
+    void heightfieldBands(bool with_obstacles);
+    void streamHeights(int level);
   public:
+    // Vertex attribute locations used by the shaders
+    enum {GRID_ATTRIB = 0, HEIGHT_ATTRIB = 1};
     surfaceMesh(int w, int h, float spacing);
     ~surfaceMesh();
+    void initGL();
     void reset();
     void procedural(float time);
     void proceduralDevice(float time);
@@ -25,8 +56,10 @@ class surfaceMesh {
     void addHFRipple(int x, int y);
     void heightfieldObstacle();
     void heightfieldObstacleDevice();
-    void drawMesh();
-    void toggleMeshMode();
+    void specialize(bool with_obstacles);
+    void buildPyramid();
+    void drawMesh(double distance, double fov, int viewport_height);
+    void setMeshMode(int _mesh_mode);
 };
 
 #endif